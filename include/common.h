@@ -23,6 +23,11 @@
 
 #define CONTROL_PORT 2121
 #define BUFFER_SIZE 1024
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define UPGRADE_SOCKET_PATH "ftp-server.upgrade.sock"
+#define UPGRADE_PROTOCOL_VERSION 2
+#define UPGRADE_READY_TIMEOUT_SEC 10
+#define UPGRADE_DRAIN_TIMEOUT_SEC 300
 
 std::vector<std::string> splitCommand(const std::string& command);
 
@@ -0,0 +1,33 @@
+//
+// Created by iliut on 12/4/24.
+//
+
+#ifndef FILE_COPY_H
+#define FILE_COPY_H
+
+#include "common.h"
+
+#include <atomic>
+#include <memory>
+
+// Copies are written under this hidden prefix next to the target and renamed into place
+#define PARTIAL_COPY_PREFIX ".ftp-copy."
+
+enum CopyStatus {
+    COPY_RUNNING,
+    COPY_DONE,
+    COPY_FAILED
+};
+
+struct CopyJob {
+    std::string from;
+    std::string to;
+    off_t totalBytes = 0;
+    std::atomic<off_t> copiedBytes{0};
+    std::atomic<CopyStatus> status{COPY_RUNNING};
+};
+
+void runCopyJob(std::shared_ptr<CopyJob> job);
+void abandonRunningCopies();
+
+#endif // FILE_COPY_H
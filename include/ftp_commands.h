@@ -6,6 +6,15 @@
 #define FTP_COMMANDS_H
 
 #include "common.h"
+#include "file_copy.h"
+
+struct SessionState {
+    bool isAuthenticated = false;
+    std::string username;
+    std::string transferType = "I";
+    int dataSocket = -1;
+    std::string renameFrom;
+};
 
 void handlePortCommand(const std::vector<std::string>& tokens, sockaddr_in& dataAddr, int& dataSocket, int clientSocket);
 int startPassiveDataConnection(sockaddr_in& dataAddr, int& dataSocket, int clientSocket);
@@ -18,7 +27,11 @@ void handleMdtmCommand(const std::vector<std::string>& tokens, int clientSocket)
 void handleTypeCommand(const std::vector<std::string>& tokens, int clientSocket);
 void handleSizeCommand(const std::vector<std::string>& tokens, int clientSocket);
 void handleListCommand(int dataClientSocket, int clientSocket);
+void handleRnfrCommand(const std::vector<std::string>& tokens, int clientSocket, std::string& renameFrom);
+void handleRntoCommand(const std::vector<std::string>& tokens, int clientSocket, const std::string& renameFrom);
+void handleSiteCommand(const std::vector<std::string>& tokens, int clientSocket, std::shared_ptr<CopyJob>& copyJob);
 void handleClient(int clientSocket);
+void resumeClient(int clientSocket, SessionState state);
 
 #endif // FTP_COMMANDS_H
 
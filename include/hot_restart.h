@@ -0,0 +1,24 @@
+//
+// Created by iliut on 12/4/24.
+//
+
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include "common.h"
+#include "ftp_commands.h"
+
+void initHotRestart();
+int upgradeWakeFd();
+void runUpgradeListener(int serverSocket);
+int takeOverListeningSocket(int& upgradeChannel);
+bool confirmTakeover(int upgradeChannel);
+void receiveHandedOffSessions(int upgradeChannel);
+bool handOffSession(int clientSocket, const SessionState& state);
+bool finishUpgrade();
+void registerSession();
+void unregisterSession();
+void registerBackgroundTask();
+void unregisterBackgroundTask();
+
+#endif // HOT_RESTART_H
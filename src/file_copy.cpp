@@ -0,0 +1,147 @@
+//
+// Created by iliut on 12/4/24.
+//
+
+#include "file_copy.h"
+#include "hot_restart.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <map>
+#include <mutex>
+#include <sys/ioctl.h>
+
+static std::mutex partialCopiesMutex;
+static std::map<std::string, std::string> partialCopies; // partial path -> "<from> to <to>"
+
+static void trackPartialCopy(const std::string& partialPath, const CopyJob& job) {
+    std::lock_guard<std::mutex> lock(partialCopiesMutex);
+    partialCopies[partialPath] = job.from + " to " + job.to;
+}
+
+static void untrackPartialCopy(const std::string& partialPath) {
+    std::lock_guard<std::mutex> lock(partialCopiesMutex);
+    partialCopies.erase(partialPath);
+}
+
+static bool streamCopy(int sourceFd, int targetFd, CopyJob& job) {
+    std::vector<char> buffer(COPY_BUFFER_SIZE);
+
+    while (true) {
+        ssize_t bytesRead = read(sourceFd, buffer.data(), buffer.size());
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            perror("Copy read failed");
+            return false;
+        }
+        if (bytesRead == 0) {
+            return true;
+        }
+
+        ssize_t written = 0;
+        while (written < bytesRead) {
+            ssize_t result = write(targetFd, buffer.data() + written, bytesRead - written);
+            if (result < 0) {
+                if (errno == EINTR) continue;
+                perror("Copy write failed");
+                return false;
+            }
+            written += result;
+        }
+        job.copiedBytes += bytesRead;
+    }
+}
+
+static bool copyContents(int sourceFd, int targetFd, CopyJob& job) {
+#ifdef FICLONE
+    // Share the extents outright when the filesystem supports reflinks
+    if (ioctl(targetFd, FICLONE, sourceFd) == 0) {
+        job.copiedBytes = job.totalBytes;
+        return true;
+    }
+#endif
+
+    // Let the kernel copy without bouncing the data through user space
+    while (true) {
+        ssize_t copied = copy_file_range(sourceFd, nullptr, targetFd, nullptr, COPY_BUFFER_SIZE, 0);
+        if (copied > 0) {
+            job.copiedBytes += copied;
+            continue;
+        }
+        if (copied == 0) {
+            return true;
+        }
+        if (errno == EINTR) continue;
+
+        // copy_file_range advances both offsets, so streaming picks up where it stopped
+        if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+            return streamCopy(sourceFd, targetFd, job);
+        }
+
+        perror("copy_file_range failed");
+        return false;
+    }
+}
+
+void runCopyJob(std::shared_ptr<CopyJob> job) {
+    const std::string sourcePath = "storage/" + job->from;
+    const std::string targetPath = "storage/" + job->to;
+    // mkstemp picks a fresh hidden name, so neither user files nor concurrent copies get clobbered
+    const std::string targetDir = targetPath.substr(0, targetPath.rfind('/'));
+    std::string partialPath = targetDir + "/" PARTIAL_COPY_PREFIX "XXXXXX";
+
+    bool copyFailed = true;
+
+    int sourceFd = open(sourcePath.c_str(), O_RDONLY);
+    if (sourceFd < 0) {
+        perror("Copy source open failed");
+    } else {
+        struct stat st;
+        int targetFd = -1;
+        if (fstat(sourceFd, &st) < 0) {
+            perror("Copy source stat failed");
+        } else if ((targetFd = mkstemp(partialPath.data())) < 0) {
+            perror("Copy target open failed");
+        }
+
+        if (targetFd >= 0) {
+            trackPartialCopy(partialPath, *job);
+
+            if (fchmod(targetFd, st.st_mode & 0777) < 0) {
+                perror("Copy target chmod failed");
+            } else {
+                copyFailed = !copyContents(sourceFd, targetFd, *job);
+            }
+            if (close(targetFd) < 0) {
+                perror("Copy target close failed");
+                copyFailed = true;
+            }
+
+            // Publish the copy atomically so nobody sees a half-written target
+            if (!copyFailed && rename(partialPath.c_str(), targetPath.c_str()) < 0) {
+                perror("Copy rename failed");
+                copyFailed = true;
+            }
+            if (copyFailed) {
+                unlink(partialPath.c_str());
+            }
+            untrackPartialCopy(partialPath);
+        }
+        close(sourceFd);
+    }
+
+    job->status = copyFailed ? COPY_FAILED : COPY_DONE;
+
+    // Paired with the registerBackgroundTask() made when the copy was started
+    unregisterBackgroundTask();
+}
+
+void abandonRunningCopies() {
+    std::lock_guard<std::mutex> lock(partialCopiesMutex);
+    for (const auto& [partialPath, description] : partialCopies) {
+        std::cerr << "Aborting unfinished copy of " << description << ".\n";
+        unlink(partialPath.c_str());
+    }
+    partialCopies.clear();
+}
@@ -3,8 +3,11 @@
 //
 
 #include "ftp_commands.h"
+#include "hot_restart.h"
 #include "user_auth.h"
 
+#include <poll.h>
+
 void handlePortCommand(const std::vector<std::string>& tokens, sockaddr_in& dataAddr, int& dataSocket, int clientSocket) {
     if (tokens.size() < 2) {
         send(clientSocket, "501 Syntax error in parameters or arguments.\r\n", 46, 0);
@@ -343,6 +346,9 @@ void handleListCommand(int dataClientSocket, int clientSocket) {
         if (std::string(entry->d_name) == "." || std::string(entry->d_name) == "..") {
             continue; // Skip current and parent directory entries
         }
+        if (std::string(entry->d_name).rfind(PARTIAL_COPY_PREFIX, 0) == 0) {
+            continue; // Skip copies still being written
+        }
         listData += entry->d_name;
         listData += "\r\n";
     }
@@ -368,18 +374,158 @@ void handleListCommand(int dataClientSocket, int clientSocket) {
     send(clientSocket, "226 Directory send OK.\r\n", 24, 0);
 }
 
-void handleClient(int clientSocket) {
+void handleRnfrCommand(const std::vector<std::string>& tokens, int clientSocket, std::string& renameFrom) {
+    if (tokens.size() < 2) {
+        send(clientSocket, "501 Syntax error in parameters or arguments.\r\n", 46, 0);
+        return;
+    }
+
+    const std::string& filename = tokens[1];
+    if (filename.find("..") != std::string::npos) {
+        send(clientSocket, "550 Invalid file name.\r\n", 24, 0);
+        return;
+    }
+
+    const std::string filePath = "storage/" + filename;
+    struct stat st;
+    if (stat(filePath.c_str(), &st) == 0) {
+        renameFrom = filename;
+        send(clientSocket, "350 Requested file action pending further information.\r\n", 56, 0);
+    } else {
+        send(clientSocket, "550 File not found.\r\n", 21, 0);
+    }
+}
+
+void handleRntoCommand(const std::vector<std::string>& tokens, int clientSocket, const std::string& renameFrom) {
+    if (renameFrom.empty()) {
+        send(clientSocket, "503 Bad sequence of commands.\r\n", 31, 0);
+        return;
+    }
+
+    if (tokens.size() < 2) {
+        send(clientSocket, "501 Syntax error in parameters or arguments.\r\n", 46, 0);
+        return;
+    }
+
+    const std::string& filename = tokens[1];
+    if (filename.find("..") != std::string::npos) {
+        send(clientSocket, "553 Invalid file name.\r\n", 24, 0);
+        return;
+    }
+
+    // rename() replaces the target atomically, even across directories inside storage
+    const std::string fromPath = "storage/" + renameFrom;
+    const std::string toPath = "storage/" + filename;
+    if (rename(fromPath.c_str(), toPath.c_str()) == 0) {
+        send(clientSocket, "250 Rename successful.\r\n", 24, 0);
+    } else {
+        perror("Rename failed");
+        send(clientSocket, "553 Rename failed.\r\n", 20, 0);
+    }
+}
+
+void handleSiteCommand(const std::vector<std::string>& tokens, int clientSocket, std::shared_ptr<CopyJob>& copyJob) {
+    if (tokens.size() < 2) {
+        send(clientSocket, "501 Syntax error in parameters or arguments.\r\n", 46, 0);
+        return;
+    }
+
+    const std::string& subcommand = tokens[1];
+    if (subcommand == "COPYSTAT") {
+        if (!copyJob) {
+            send(clientSocket, "211 No copy started.\r\n", 22, 0);
+            return;
+        }
+
+        std::string progress = copyJob->from + " to " + copyJob->to + ": " +
+                               std::to_string(copyJob->copiedBytes.load()) + "/" +
+                               std::to_string(copyJob->totalBytes) + " bytes";
+        std::string response;
+        switch (copyJob->status.load()) {
+            case COPY_RUNNING: response = "211 Copying " + progress + ".\r\n"; break;
+            case COPY_DONE: response = "211 Copied " + progress + ".\r\n"; break;
+            case COPY_FAILED: response = "211 Copy failed " + progress + ".\r\n"; break;
+        }
+        send(clientSocket, response.c_str(), response.size(), 0);
+    } else if (subcommand == "COPY") {
+        if (tokens.size() < 4) {
+            send(clientSocket, "501 Syntax error in parameters or arguments.\r\n", 46, 0);
+            return;
+        }
+
+        const std::string& from = tokens[2];
+        const std::string& to = tokens[3];
+        if (from.find("..") != std::string::npos || to.find("..") != std::string::npos) {
+            send(clientSocket, "550 Invalid file name.\r\n", 24, 0);
+            return;
+        }
+
+        if (copyJob && copyJob->status == COPY_RUNNING) {
+            send(clientSocket, "450 A copy is already in progress.\r\n", 36, 0);
+            return;
+        }
+
+        const std::string fromPath = "storage/" + from;
+        struct stat st;
+        if (stat(fromPath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            send(clientSocket, "550 File not found.\r\n", 21, 0);
+            return;
+        }
+
+        copyJob = std::make_shared<CopyJob>();
+        copyJob->from = from;
+        copyJob->to = to;
+        copyJob->totalBytes = st.st_size;
+
+        // An upgrade waits for the copy to land before the old process exits
+        registerBackgroundTask();
+        std::thread copyThread(runCopyJob, copyJob);
+        copyThread.detach();
+
+        send(clientSocket, "200 Copy started; use SITE COPYSTAT for progress.\r\n", 51, 0);
+    } else {
+        send(clientSocket, "504 Command not implemented for that parameter.\r\n", 49, 0);
+    }
+}
+
+static void serveSession(int clientSocket, const SessionState& state) {
     char buffer[BUFFER_SIZE];
-    bool isAuthenticated = false;
-    std::string username;
-    std::string transferType = "I"; // Default to binary mode
+    bool isAuthenticated = state.isAuthenticated;
+    std::string username = state.username;
+    std::string transferType = state.transferType;
 
-    int dataSocket = -1;
+    int dataSocket = state.dataSocket;
     sockaddr_in dataAddr{};
 
-    send(clientSocket, "220 Welcome to FTP Server\r\n", 27, 0);
+    std::string renameFrom = state.renameFrom;
+    std::shared_ptr<CopyJob> copyJob;
+
+    bool canHandOff = true;
+    bool handedOff = false;
 
     while (true) {
+        // Wait between commands so an upgrade never interrupts a transfer
+        // and stay put while our copy runs here, so SITE COPYSTAT keeps reporting it
+        bool copyRunning = copyJob && copyJob->status == COPY_RUNNING;
+        bool watchUpgrade = canHandOff && !copyRunning;
+        pollfd fds[2] = {{clientSocket, POLLIN, 0}, {upgradeWakeFd(), POLLIN, 0}};
+        int ready = poll(fds, watchUpgrade ? 2 : 1, copyRunning ? 1000 : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("Poll failed");
+            break;
+        }
+        if (ready == 0) continue;
+
+        if (watchUpgrade && (fds[1].revents & POLLIN)) {
+            if (handOffSession(clientSocket, {isAuthenticated, username, transferType, dataSocket, renameFrom})) {
+                handedOff = true;
+                break;
+            }
+            canHandOff = false;
+            continue;
+        }
+
         memset(buffer, 0, BUFFER_SIZE);
         int bytesRead = recv(clientSocket, buffer, BUFFER_SIZE - 1, 0);
         if (bytesRead <= 0) {
@@ -393,6 +539,11 @@ void handleClient(int clientSocket) {
         if (tokens.empty()) continue;
 
         std::string cmd = tokens[0];
+
+        // RNTO is only valid directly after RNFR
+        std::string pendingRename = std::move(renameFrom);
+        renameFrom.clear();
+
         if (cmd == "USER") {
             std::cout << "Received USER command: " << tokens[1] << "\n";
 
@@ -440,6 +591,12 @@ void handleClient(int clientSocket) {
             handleMdtmCommand(tokens, clientSocket);
         } else if (cmd == "TYPE") {
             handleTypeCommand(tokens, clientSocket);
+        } else if (cmd == "RNFR") {
+            handleRnfrCommand(tokens, clientSocket, renameFrom);
+        } else if (cmd == "RNTO") {
+            handleRntoCommand(tokens, clientSocket, pendingRename);
+        } else if (cmd == "SITE") {
+            handleSiteCommand(tokens, clientSocket, copyJob);
         } else if (cmd == "PORT") {
             handlePortCommand(tokens, dataAddr, dataSocket, clientSocket);
         } else if (cmd == "PASV") {
@@ -506,5 +663,25 @@ void handleClient(int clientSocket) {
     }
 
     close(clientSocket);
-    std::cout << "Client disconnected\n";
+    if (handedOff) {
+        if (dataSocket >= 0) {
+            close(dataSocket);
+        }
+        std::cout << "Client handed off to new server process\n";
+    } else {
+        std::cout << "Client disconnected\n";
+    }
+
+    // Registered by whoever spawned this thread, before it started
+    unregisterSession();
+}
+
+void handleClient(int clientSocket) {
+    send(clientSocket, "220 Welcome to FTP Server\r\n", 27, 0);
+    serveSession(clientSocket, SessionState{});
+}
+
+void resumeClient(int clientSocket, SessionState state) {
+    std::cout << "Client resumed from previous server process\n";
+    serveSession(clientSocket, state);
 }
\ No newline at end of file
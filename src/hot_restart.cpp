@@ -0,0 +1,353 @@
+//
+// Created by iliut on 12/4/24.
+//
+
+#include "hot_restart.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_HANDOFF_FDS 2
+// Room for a username and a rename source of a full command each, plus the header fields
+#define MAX_HANDOFF_MESSAGE_SIZE (2 * BUFFER_SIZE + 64)
+
+static int wakePipe[2] = {-1, -1};
+
+static std::mutex channelMutex;
+static int activeChannel = -1;
+
+static std::mutex sessionMutex;
+static std::condition_variable sessionsDrained;
+static int activeSessions = 0;
+static int activeBackgroundTasks = 0;
+
+static bool sendMessage(int channel, const std::string& message, const int* fds, size_t fdCount) {
+    iovec iov{const_cast<char*>(message.data()), message.size()};
+    char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)] = {};
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fdCount > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+    }
+
+    return sendmsg(channel, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(message.size());
+}
+
+static std::string versionedMessage(const std::string& kind) {
+    return kind + '\0' + std::to_string(UPGRADE_PROTOCOL_VERSION);
+}
+
+// A truncated message comes back empty, so callers reject it as malformed
+static ssize_t receiveMessage(int channel, std::string& message, std::vector<int>& fds) {
+    char buffer[MAX_HANDOFF_MESSAGE_SIZE];
+    iovec iov{buffer, sizeof(buffer)};
+    char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)] = {};
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t bytesRead = recvmsg(channel, &msg, 0);
+    if (bytesRead <= 0) {
+        return bytesRead;
+    }
+
+    message.assign(buffer, bytesRead);
+    fds.clear();
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            fds.assign(received, received + count);
+        }
+    }
+
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        for (int fd : fds) {
+            close(fd);
+        }
+        fds.clear();
+        message.clear();
+    }
+    return bytesRead;
+}
+
+static bool waitForReady(int channel) {
+    pollfd fds[1] = {{channel, POLLIN, 0}};
+    if (poll(fds, 1, UPGRADE_READY_TIMEOUT_SEC * 1000) <= 0) {
+        return false;
+    }
+
+    std::string message;
+    std::vector<int> received;
+    if (receiveMessage(channel, message, received) <= 0 || message != versionedMessage("READY") ||
+        !received.empty()) {
+        for (int fd : received) {
+            close(fd);
+        }
+        return false;
+    }
+
+    // Acknowledge, so the new process knows we saw READY in time and will stop accepting
+    return sendMessage(channel, "ACK", nullptr, 0);
+}
+
+void initHotRestart() {
+    if (pipe(wakePipe) < 0) {
+        perror("Upgrade pipe creation failed");
+    }
+}
+
+int upgradeWakeFd() {
+    return wakePipe[0];
+}
+
+void runUpgradeListener(int serverSocket) {
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (listener < 0) {
+        perror("Upgrade socket creation failed");
+        return;
+    }
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, UPGRADE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+    unlink(UPGRADE_SOCKET_PATH);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Upgrade socket bind failed");
+        close(listener);
+        return;
+    }
+
+    if (listen(listener, 1) < 0) {
+        perror("Upgrade socket listen failed");
+        close(listener);
+        return;
+    }
+
+    while (true) {
+        int channel = accept(listener, nullptr, nullptr);
+        if (channel < 0) {
+            perror("Upgrade accept failed");
+            continue;
+        }
+
+        // Only a process running as the same user may take over our sockets
+        ucred peer{};
+        socklen_t peerLen = sizeof(peer);
+        if (getsockopt(channel, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen) < 0 || peer.uid != getuid()) {
+            std::cerr << "Rejected upgrade request from another user.\n";
+            close(channel);
+            continue;
+        }
+
+        if (!sendMessage(channel, versionedMessage("LISTEN"), &serverSocket, 1)) {
+            perror("Listening socket handoff failed");
+            close(channel);
+            continue;
+        }
+
+        // Keep serving unless the new process confirms it is accepting on the socket
+        if (!waitForReady(channel)) {
+            std::cerr << "New server process did not confirm takeover; continuing to serve.\n";
+            close(channel);
+            continue;
+        }
+
+        std::cout << "Handing off to new server process...\n";
+        close(listener);
+
+        {
+            std::lock_guard<std::mutex> lock(channelMutex);
+            activeChannel = channel;
+        }
+
+        // The pipe is never drained, so every poller sees it as readable from now on
+        if (write(wakePipe[1], "U", 1) < 0) {
+            perror("Upgrade wake-up failed");
+        }
+        return;
+    }
+}
+
+int takeOverListeningSocket(int& upgradeChannel) {
+    upgradeChannel = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (upgradeChannel < 0) {
+        perror("Upgrade socket creation failed");
+        return -1;
+    }
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, UPGRADE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+    if (connect(upgradeChannel, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Connecting to running server failed");
+        close(upgradeChannel);
+        upgradeChannel = -1;
+        return -1;
+    }
+
+    std::string message;
+    std::vector<int> fds;
+    bool received = receiveMessage(upgradeChannel, message, fds) > 0;
+    if (!received || message != versionedMessage("LISTEN") || fds.size() != 1) {
+        if (received && message.rfind(std::string("LISTEN"), 0) == 0) {
+            std::cerr << "Running server speaks a different upgrade protocol; it keeps serving.\n";
+        } else {
+            std::cerr << "Running server did not hand off its listening socket.\n";
+        }
+        for (int fd : fds) {
+            close(fd);
+        }
+        close(upgradeChannel);
+        upgradeChannel = -1;
+        return -1;
+    }
+
+    return fds[0];
+}
+
+bool confirmTakeover(int upgradeChannel) {
+    if (!sendMessage(upgradeChannel, versionedMessage("READY"), nullptr, 0)) {
+        perror("Takeover confirmation failed");
+        return false;
+    }
+
+    // Without the ack the old process gave up on us and is still accepting
+    pollfd fds[1] = {{upgradeChannel, POLLIN, 0}};
+    std::string message;
+    std::vector<int> received;
+    if (poll(fds, 1, UPGRADE_READY_TIMEOUT_SEC * 1000) <= 0 ||
+        receiveMessage(upgradeChannel, message, received) <= 0 || message != "ACK" || !received.empty()) {
+        for (int fd : received) {
+            close(fd);
+        }
+        std::cerr << "Running server did not acknowledge takeover.\n";
+        return false;
+    }
+    return true;
+}
+
+void receiveHandedOffSessions(int upgradeChannel) {
+    std::string message;
+    std::vector<int> fds;
+
+    while (receiveMessage(upgradeChannel, message, fds) > 0) {
+        if (message == "DONE") {
+            break;
+        }
+
+        // SESSION, authenticated, type, hasDataSocket, username, renameFrom; NUL separated
+        // since none of these can contain a NUL coming from the command buffer
+        std::istringstream stream(message);
+        std::string kind;
+        std::string authenticated;
+        std::string hasDataSocket;
+        SessionState state;
+        std::getline(stream, kind, '\0');
+        std::getline(stream, authenticated, '\0');
+        std::getline(stream, state.transferType, '\0');
+        std::getline(stream, hasDataSocket, '\0');
+        std::getline(stream, state.username, '\0');
+        std::getline(stream, state.renameFrom, '\0');
+
+        if (kind != "SESSION" || fds.size() != (hasDataSocket == "1" ? 2u : 1u)) {
+            std::cerr << "Dropping malformed session handoff.\n";
+            for (int fd : fds) {
+                close(fd);
+            }
+            continue;
+        }
+
+        state.isAuthenticated = authenticated == "1";
+        state.dataSocket = hasDataSocket == "1" ? fds[1] : -1;
+
+        registerSession();
+        std::thread clientThread(resumeClient, fds[0], state);
+        clientThread.detach();
+    }
+
+    close(upgradeChannel);
+    std::cout << "Previous server process finished handing off\n";
+}
+
+bool handOffSession(int clientSocket, const SessionState& state) {
+    std::lock_guard<std::mutex> lock(channelMutex);
+    if (activeChannel < 0) {
+        return false;
+    }
+
+    std::string message = std::string("SESSION") + '\0' + (state.isAuthenticated ? "1" : "0") + '\0' +
+                          state.transferType + '\0' + (state.dataSocket >= 0 ? "1" : "0") + '\0' +
+                          state.username + '\0' + state.renameFrom;
+    // Keep the session here rather than have the receiver truncate it
+    if (message.size() > MAX_HANDOFF_MESSAGE_SIZE) {
+        return false;
+    }
+
+    int fds[MAX_HANDOFF_FDS] = {clientSocket, state.dataSocket};
+    return sendMessage(activeChannel, message, fds, state.dataSocket >= 0 ? 2 : 1);
+}
+
+bool finishUpgrade() {
+    bool drained;
+    {
+        std::unique_lock<std::mutex> lock(sessionMutex);
+        drained = sessionsDrained.wait_for(lock, std::chrono::seconds(UPGRADE_DRAIN_TIMEOUT_SEC),
+                                           [] { return activeSessions == 0 && activeBackgroundTasks == 0; });
+        if (!drained) {
+            std::cerr << "Timed out draining " << activeSessions << " session(s) and "
+                      << activeBackgroundTasks << " background task(s).\n";
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(channelMutex);
+    if (activeChannel >= 0) {
+        sendMessage(activeChannel, "DONE", nullptr, 0);
+        close(activeChannel);
+        activeChannel = -1;
+    }
+    return drained;
+}
+
+void registerSession() {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    ++activeSessions;
+}
+
+void unregisterSession() {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    if (--activeSessions == 0 && activeBackgroundTasks == 0) {
+        sessionsDrained.notify_all();
+    }
+}
+
+void registerBackgroundTask() {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    ++activeBackgroundTasks;
+}
+
+void unregisterBackgroundTask() {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    if (--activeBackgroundTasks == 0 && activeSessions == 0) {
+        sessionsDrained.notify_all();
+    }
+}
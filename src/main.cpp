@@ -1,33 +1,78 @@
 #include "common.h"
 #include "ftp_commands.h"
+#include "hot_restart.h"
 
-int main() {
+#include <poll.h>
+
+int main(int argc, char* argv[]) {
     signal(SIGPIPE, SIG_IGN);
 
-    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket == -1) {
-        perror("Socket creation failed");
-        return 1;
-    }
+    initHotRestart();
 
-    sockaddr_in serverAddr{};
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(CONTROL_PORT);
+    int serverSocket = -1;
+    int upgradeChannel = -1;
 
-    if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-        perror("Bind failed");
-        return 1;
-    }
+    if (argc > 1 && strcmp(argv[1], "--upgrade") == 0) {
+        // Take over the listening socket and idle sessions of the running server
+        serverSocket = takeOverListeningSocket(upgradeChannel);
+        if (serverSocket < 0) {
+            return 1;
+        }
+    } else {
+        serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+        if (serverSocket == -1) {
+            perror("Socket creation failed");
+            return 1;
+        }
+
+        sockaddr_in serverAddr{};
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = INADDR_ANY;
+        serverAddr.sin_port = htons(CONTROL_PORT);
 
-    if (listen(serverSocket, 5) < 0) {
-        perror("Listen failed");
-        return 1;
+        if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            perror("Bind failed");
+            return 1;
+        }
+
+        if (listen(serverSocket, 5) < 0) {
+            perror("Listen failed");
+            return 1;
+        }
     }
 
     std::cout << "FTP Server listening on port " << CONTROL_PORT << "...\n";
 
+    if (upgradeChannel >= 0) {
+        // Only now may the old process stop accepting and start draining
+        if (!confirmTakeover(upgradeChannel)) {
+            return 1;
+        }
+
+        std::thread handoffThread(receiveHandedOffSessions, upgradeChannel);
+        handoffThread.detach();
+    }
+
+    std::thread upgradeThread(runUpgradeListener, serverSocket);
+    upgradeThread.detach();
+
     while (true) {
+        pollfd fds[2] = {{serverSocket, POLLIN, 0}, {upgradeWakeFd(), POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                perror("Poll failed");
+            }
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
         sockaddr_in clientAddr{};
         socklen_t clientLen = sizeof(clientAddr);
         int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientLen);
@@ -38,10 +83,21 @@ int main() {
 
         std::cout << "Client connected\n";
 
+        // Count the session before the thread exists so a drain can never miss it
+        registerSession();
         std::thread clientThread(handleClient, clientSocket);
         clientThread.detach();
     }
 
+    // A new process owns the listening socket now; wait for our sessions to finish or move over
+    if (!finishUpgrade()) {
+        // Stragglers still run on detached threads; skip static destructors under them
+        abandonRunningCopies();
+        std::cout << "Upgrade drain timed out, exiting\n" << std::flush;
+        std::cerr << std::flush;
+        _exit(1);
+    }
     close(serverSocket);
+    std::cout << "Upgrade complete, exiting\n";
     return 0;
 }